@@ -10,6 +10,15 @@
 #include "threading/thread.h"
 #include "http/httprequest.h"
 #include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#if !__WIN32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 #if __WIN32__
 // under Windows, make sure to use the self-compiled CURL
@@ -25,7 +34,27 @@ namespace Http
 __ImplementClass(Http::CurlHttpClient, 'CHTC', Core::RefCounted);
 
 bool CurlHttpClient::curlInitCalled = false;
+Timing::Timer CurlHttpClient::processTimer;
 Threading::CriticalSection CurlHttpClient::curlInitCriticalSection;
+CURLSH* CurlHttpClient::curlShareHandle = 0;
+Threading::CriticalSection CurlHttpClient::curlShareCriticalSections[CURL_LOCK_DATA_LAST];
+Util::String CurlHttpClient::persistentCacheDirectory;
+Util::String CurlHttpClient::persistentCacheFile;
+Timing::Time CurlHttpClient::persistentCacheFlushInterval = 60.0;
+Timing::Time CurlHttpClient::persistentCacheFlushTime = 0.0;
+Threading::CriticalSection CurlHttpClient::persistentCacheCriticalSection;
+CURL* CurlHttpClient::persistentCacheHandle = 0;
+bool CurlHttpClient::persistentCacheWritten = false;
+Util::String CurlHttpClient::altSvcCacheFile;
+bool CurlHttpClient::altSvcCacheOwned = false;
+SizeT CurlHttpClient::numClients = 0;
+#if __NEBULA3_HTTP_FILESYSTEM_CURL_VERBOSE_MODE__
+bool CurlHttpClient::traceEnabled = true;
+#else
+bool CurlHttpClient::traceEnabled = false;
+#endif
+SizeT CurlHttpClient::traceSampleInterval = 1;
+bool CurlHttpClient::dumpTraceOnError = true;
 
 using namespace Util;
 using namespace IO;
@@ -109,6 +138,370 @@ CurlHttpClient::CurlWriteData(char* ptr, size_t size, size_t nmemb, void* userda
     }
 }
 
+//------------------------------------------------------------------------------
+/**
+    Curl share lock callback, there's one critical section per shared data type.
+*/
+void
+CurlHttpClient::CurlShareLock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+    curlShareCriticalSections[data].Enter();
+}
+
+//------------------------------------------------------------------------------
+/**
+    Curl share unlock callback.
+*/
+void
+CurlHttpClient::CurlShareUnlock(CURL* handle, curl_lock_data data, void* userptr)
+{
+    curlShareCriticalSections[data].Leave();
+}
+
+//------------------------------------------------------------------------------
+/**
+    Setup the process-wide curl share handle, so that all clients (and
+    reconnects of the same client) resume TLS sessions and reuse DNS
+    results instead of doing a full handshake on every new connection.
+
+    If a persistent cache directory has been set, the shared TLS sessions
+    are also loaded from a cache file, so that a restarted process can
+    resume sessions right away. The file is owned by a private curl handle
+    attached to the share handle, clients never touch it. It is written
+    back after the first request (so that short-lived processes persist
+    their sessions), then periodically after requests (see 
+    CheckFlushPersistentCache()), when the last client is destroyed and
+    at process exit.
+
+    The Alt-Svc cache (learned protocol upgrades, curl 7.64.1 and later)
+    is persisted into a second file, see AttachAltSvcCache() for details.
+
+    NOTE: exporting and importing TLS sessions requires curl 8.12
+    (curl_easy_ssls_export/import), with older curl versions (like the
+    self-compiled Windows curl) sessions are only shared within the process.
+    HSTS isn't cached since every request is upgraded to https anyway.
+*/
+void
+CurlHttpClient::SetupSharedCache()
+{
+    n_assert(0 == curlShareHandle);
+    curlShareHandle = curl_share_init();
+    n_assert2(0 != curlShareHandle, "CurlHttpClient: curl_share_init() failed!\n");
+    curl_share_setopt(curlShareHandle, CURLSHOPT_LOCKFUNC, CurlShareLock);
+    curl_share_setopt(curlShareHandle, CURLSHOPT_UNLOCKFUNC, CurlShareUnlock);
+    curl_share_setopt(curlShareHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(curlShareHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+
+    #if LIBCURL_VERSION_NUM >= 0x074001
+    if (persistentCacheDirectory.IsValid())
+    {
+        altSvcCacheFile.Format("%s/curl_altsvc.txt", persistentCacheDirectory.AsCharPtr());
+    }
+    #endif
+    #if LIBCURL_VERSION_NUM >= 0x080C00
+    if (persistentCacheDirectory.IsValid())
+    {
+        persistentCacheFile.Format("%s/curl_tls_sessions.bin", persistentCacheDirectory.AsCharPtr());
+        persistentCacheHandle = curl_easy_init();
+        n_assert2(0 != persistentCacheHandle, "CurlHttpClient: curl_easy_init() failed!\n");
+        curl_easy_setopt(persistentCacheHandle, CURLOPT_SHARE, curlShareHandle);
+        LoadPersistentCache();
+        persistentCacheFlushTime = processTimer.GetTime();
+        atexit(PersistentCacheAtExit);
+    }
+    #endif
+}
+
+//------------------------------------------------------------------------------
+/**
+    Attach the persistent Alt-Svc cache file to the client's curl handle.
+    Curl keeps the Alt-Svc cache per easy handle, loads it from the file
+    when the option is set and writes it back in curl_easy_cleanup(), 
+    there's no way to share it between handles. To avoid that clients
+    overwrite each other's file, only one client at a time owns the file
+    and writes it back on Disconnect(), all other clients load it read-only.
+    Handles of batched requests don't use the file at all, so that batches
+    don't cause any file access.
+*/
+void
+CurlHttpClient::AttachAltSvcCache()
+{
+    #if LIBCURL_VERSION_NUM >= 0x074001
+    if (altSvcCacheFile.IsValid())
+    {
+        Threading::ContextLock lock(persistentCacheCriticalSection);
+        n_assert(!this->altSvcCacheOwner);
+        long ctrl = CURLALTSVC_H1 | CURLALTSVC_H2;
+        if (!altSvcCacheOwned)
+        {
+            altSvcCacheOwned = true;
+            this->altSvcCacheOwner = true;
+        }
+        else
+        {
+            ctrl |= CURLALTSVC_READONLYFILE;
+        }
+        curl_easy_setopt(this->curlHandle, CURLOPT_ALTSVC_CTRL, ctrl);
+        curl_easy_setopt(this->curlHandle, CURLOPT_ALTSVC, altSvcCacheFile.AsCharPtr());
+    }
+    #endif
+}
+
+//------------------------------------------------------------------------------
+/**
+    Called after the client's curl handle has been cleaned up (which has
+    written the Alt-Svc cache file), so that the next client can take over.
+*/
+void
+CurlHttpClient::ReleaseAltSvcCache()
+{
+    if (this->altSvcCacheOwner)
+    {
+        Threading::ContextLock lock(persistentCacheCriticalSection);
+        n_assert(altSvcCacheOwned);
+        altSvcCacheOwned = false;
+        this->altSvcCacheOwner = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Exit hook, writes the persistent cache for processes which don't
+    destroy their clients before exiting.
+*/
+void
+CurlHttpClient::PersistentCacheAtExit()
+{
+    FlushPersistentCache();
+}
+
+//------------------------------------------------------------------------------
+/**
+    The persistent cache file starts with a magic number followed by one
+    entry per TLS session, each entry consists of the session key, the
+    salted hash of the key and the session data, each prefixed with
+    its 32-bit length.
+*/
+#if LIBCURL_VERSION_NUM >= 0x080C00
+static const uint PersistentCacheMagic = 0x4E335343;     // 'N3SC'
+static const uint PersistentCacheMaxEntrySize = 64 * 1024;
+
+//------------------------------------------------------------------------------
+/**
+*/
+static bool
+WriteCacheBlock(FILE* fp, const void* data, size_t size)
+{
+    uint len = (uint) size;
+    if (1 != fwrite(&len, sizeof(len), 1, fp))
+    {
+        return false;
+    }
+    return (0 == len) || (1 == fwrite(data, len, 1, fp));
+}
+
+//------------------------------------------------------------------------------
+/**
+    Read a length-prefixed block, the buffer must be at least
+    PersistentCacheMaxEntrySize + 1 bytes big, the block is 0-terminated.
+*/
+static bool
+ReadCacheBlock(FILE* fp, unsigned char* buf, size_t& outSize)
+{
+    uint len = 0;
+    if ((1 != fread(&len, sizeof(len), 1, fp)) || (len > PersistentCacheMaxEntrySize))
+    {
+        return false;
+    }
+    if ((len > 0) && (1 != fread(buf, len, 1, fp)))
+    {
+        return false;
+    }
+    buf[len] = 0;
+    outSize = len;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Create a new file which is only accessible by the owner, since it
+    will contain TLS session secrets. Under Windows, the cache directory
+    is expected to be in the user profile which is private by default.
+*/
+static FILE*
+OpenPrivateCacheFile(const Util::String& path)
+{
+    remove(path.AsCharPtr());
+    #if __WIN32__
+    return fopen(path.AsCharPtr(), "wb");
+    #else
+    int fd = open(path.AsCharPtr(), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (-1 == fd)
+    {
+        return 0;
+    }
+    FILE* fp = fdopen(fd, "wb");
+    if (0 == fp)
+    {
+        close(fd);
+    }
+    return fp;
+    #endif
+}
+
+//------------------------------------------------------------------------------
+/**
+    Atomically replace the cache file with the temp file.
+*/
+static bool
+MoveCacheFile(const Util::String& from, const Util::String& to)
+{
+    #if __WIN32__
+    return 0 != MoveFileExA(from.AsCharPtr(), to.AsCharPtr(), MOVEFILE_REPLACE_EXISTING);
+    #else
+    // rename() replaces an existing file atomically
+    return 0 == rename(from.AsCharPtr(), to.AsCharPtr());
+    #endif
+}
+
+//------------------------------------------------------------------------------
+/**
+    Curl TLS session export callback, appends one entry to the cache file.
+*/
+CURLcode
+CurlHttpClient::CurlSslsExport(CURL* handle, void* userptr, const char* sessionKey, const unsigned char* shmac, size_t shmacLen, const unsigned char* sdata, size_t sdataLen, curl_off_t validUntil, int ietfTlsId, const char* alpn, size_t earlyDataMax)
+{
+    FILE* fp = (FILE*) userptr;
+    size_t keyLen = (0 != sessionKey) ? strlen(sessionKey) : 0;
+    if ((keyLen > PersistentCacheMaxEntrySize) || (shmacLen > PersistentCacheMaxEntrySize) || (sdataLen > PersistentCacheMaxEntrySize))
+    {
+        // skip oversized sessions, the loader would reject them anyway
+        return CURLE_OK;
+    }
+    if (WriteCacheBlock(fp, sessionKey, keyLen) && WriteCacheBlock(fp, shmac, shmacLen) && WriteCacheBlock(fp, sdata, sdataLen))
+    {
+        return CURLE_OK;
+    }
+    return CURLE_WRITE_ERROR;
+}
+#endif
+
+//------------------------------------------------------------------------------
+/**
+    Load the persistent cache file into the shared TLS session cache, 
+    a missing or broken file is silently ignored.
+*/
+void
+CurlHttpClient::LoadPersistentCache()
+{
+    #if LIBCURL_VERSION_NUM >= 0x080C00
+    n_assert(0 != persistentCacheHandle);
+    FILE* fp = fopen(persistentCacheFile.AsCharPtr(), "rb");
+    if (0 == fp)
+    {
+        return;
+    }
+    uint magic = 0;
+    if ((1 == fread(&magic, sizeof(magic), 1, fp)) && (PersistentCacheMagic == magic))
+    {
+        const size_t bufSize = PersistentCacheMaxEntrySize + 1;
+        unsigned char* buf = (unsigned char*) N3_ALLOC(Memory::ScratchHeap, bufSize * 3);
+        unsigned char* key = buf;
+        unsigned char* shmac = buf + bufSize;
+        unsigned char* sdata = buf + 2 * bufSize;
+        size_t keyLen, shmacLen, sdataLen;
+        SizeT numSessions = 0;
+        while (ReadCacheBlock(fp, key, keyLen) && ReadCacheBlock(fp, shmac, shmacLen) && ReadCacheBlock(fp, sdata, sdataLen))
+        {
+            if (CURLE_OK == curl_easy_ssls_import(persistentCacheHandle, (keyLen > 0) ? (const char*) key : 0, shmac, shmacLen, sdata, sdataLen))
+            {
+                numSessions++;
+            }
+        }
+        N3_FREE(Memory::ScratchHeap, buf);
+        n_printf("CurlHttpClient: loaded %d TLS sessions from '%s'\n", numSessions, persistentCacheFile.AsCharPtr());
+    }
+    fclose(fp);
+    #endif
+}
+
+//------------------------------------------------------------------------------
+/**
+    Write the shared TLS session cache into a temp file and replace the
+    cache file with it, so that a crash never leaves a half-written file.
+*/
+void
+CurlHttpClient::WritePersistentCache()
+{
+    #if LIBCURL_VERSION_NUM >= 0x080C00
+    if (0 == persistentCacheHandle)
+    {
+        return;
+    }
+    persistentCacheFlushTime = processTimer.GetTime();
+    persistentCacheWritten = true;
+
+    // several processes may share the cache directory, so the temp file name must be unique
+    #if __WIN32__
+    uint pid = (uint) GetCurrentProcessId();
+    #else
+    uint pid = (uint) getpid();
+    #endif
+    String tmpFile;
+    tmpFile.Format("%s.%u.tmp", persistentCacheFile.AsCharPtr(), pid);
+    FILE* fp = OpenPrivateCacheFile(tmpFile);
+    if (0 == fp)
+    {
+        n_warning("CurlHttpClient: failed to open '%s' for writing!\n", tmpFile.AsCharPtr());
+        return;
+    }
+    bool success = (1 == fwrite(&PersistentCacheMagic, sizeof(PersistentCacheMagic), 1, fp));
+    if (success)
+    {
+        success = (CURLE_OK == curl_easy_ssls_export(persistentCacheHandle, CurlSslsExport, fp));
+    }
+    success = (0 == fclose(fp)) && success;
+    if (success)
+    {
+        success = MoveCacheFile(tmpFile, persistentCacheFile);
+    }
+    if (!success)
+    {
+        n_warning("CurlHttpClient: failed to write TLS session cache '%s'!\n", persistentCacheFile.AsCharPtr());
+        remove(tmpFile.AsCharPtr());
+    }
+    #endif
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+CurlHttpClient::FlushPersistentCache()
+{
+    Threading::ContextLock lock(persistentCacheCriticalSection);
+    WritePersistentCache();
+}
+
+//------------------------------------------------------------------------------
+/**
+    Called after requests, flushes the persistent cache after the first
+    request of the process (which has stored the first new TLS session)
+    and then whenever the flush interval has passed since the last flush.
+*/
+void
+CurlHttpClient::CheckFlushPersistentCache()
+{
+    if (0 != persistentCacheHandle)
+    {
+        Threading::ContextLock lock(persistentCacheCriticalSection);
+        if (!persistentCacheWritten || ((processTimer.GetTime() - persistentCacheFlushTime) >= persistentCacheFlushInterval))
+        {
+            WritePersistentCache();
+        }
+    }
+}
+
 //------------------------------------------------------------------------------
 /**
 */
@@ -117,8 +510,15 @@ CurlHttpClient::CurlHttpClient() :
     cancelOnThreadStopRequested(true),
     recvTimeout(0),
     curlHandle(0),
+    curlMultiHandle(0),
     lastRequestTime(0),
-    redirectResponseCount(0)
+    redirectResponseCount(0),
+    traceRecords(0),
+    traceHead(0),
+    traceNumRecords(0),
+    traceRequestIndex(0),
+    traceActive(false),
+    altSvcCacheOwner(false)
 {
     // check if we must setup curl, this must be called once for the 
     // whole program, and since curl_global_init() is not thread-safe
@@ -128,8 +528,12 @@ CurlHttpClient::CurlHttpClient() :
     {
         CURLcode res = curl_global_init_mem(CURL_GLOBAL_ALL, CurlMalloc, CurlFree, CurlRealloc, CurlStrdup, CurlCalloc);
         n_assert2(0 == res, "CurlHttpClient: curl_global_init() failed!\n");
+        // process-wide monotonic clock for trace timestamps, never stopped
+        processTimer.Start();
+        SetupSharedCache();
         this->curlInitCalled = true;
     }
+    numClients++;
     const SizeT curlErrorBufSize = CURL_ERROR_SIZE * 4;
     this->curlError = (char*) N3_ALLOC(Memory::ScratchHeap, curlErrorBufSize);
     Memory::Clear(this->curlError, curlErrorBufSize);
@@ -146,6 +550,19 @@ CurlHttpClient::~CurlHttpClient()
     }
     N3_FREE(Memory::ScratchHeap, this->curlError);
     this->curlError = 0;
+    if (0 != this->traceRecords)
+    {
+        N3_FREE(Memory::NetworkHeap, this->traceRecords);
+        this->traceRecords = 0;
+    }
+
+    // write the persistent cache when the last client goes away
+    Threading::ContextLock lock(this->curlInitCriticalSection);
+    n_assert(numClients > 0);
+    if (0 == --numClients)
+    {
+        FlushPersistentCache();
+    }
 }
 
 //------------------------------------------------------------------------------
@@ -165,48 +582,64 @@ CurlHttpClient::Connect(const URI& uri)
     // shared HttpClient objects
     this->curlHandle = curl_easy_init();
     n_assert2(0 != this->curlHandle, "CurlHttpClient: curl_easy_init() failed!\n");
+    this->SetupHandleOptions(this->curlHandle);
+    this->AttachAltSvcCache();
+    curl_easy_setopt(this->curlHandle, CURLOPT_ERRORBUFFER, this->curlError);
+    curl_easy_setopt(this->curlHandle, CURLOPT_URL, uri.AsString().AsCharPtr());
+    this->traceActive = false;
     
+    // setup idle timer stuff
+    if (!this->idleTimer.Running())
+    {
+        this->idleTimer.Start();
+    }
+    this->lastRequestTime = this->idleTimer.GetTime();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Set the general options of a curl easy handle, this is used for the 
+    client's own handle and for the handles of batched requests.
+*/
+void
+CurlHttpClient::SetupHandleOptions(void* handle)
+{
     // set some general options for this curl handle
     // NOTE: better don't mess with CURL timeouts, there are quite a 
     // lot of clients which take quite a long time for name resolution (for instance)
-    curl_easy_setopt(this->curlHandle, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_setopt(this->curlHandle, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
 
-    curl_easy_setopt(this->curlHandle, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(this->curlHandle, CURLOPT_COOKIEFILE, "");
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_COOKIEFILE, "");
 
     // only support http protocol
-    //curl_easy_setopt(this->curlHandle, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTPS);
+    //curl_easy_setopt(handle, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTPS);
 
-    curl_easy_setopt(this->curlHandle, CURLOPT_ERRORBUFFER, this->curlError);
-    curl_easy_setopt(this->curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteData);
-    curl_easy_setopt(this->curlHandle, CURLOPT_USERAGENT, "Mozilla");
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, CurlWriteData);
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, "Mozilla");
+    curl_easy_setopt(handle, CURLOPT_SHARE, curlShareHandle);
+    // the debug callback is only invoked while CURLOPT_VERBOSE is set, see BeginTrace()
+    curl_easy_setopt(handle, CURLOPT_DEBUGFUNCTION, CurlHttpClient::CurlDebugCallback);
+    curl_easy_setopt(handle, CURLOPT_DEBUGDATA, this);
     /*
     HMM THIS WOULD MAKE SENSE, BUT IS ONLY AVAILABLE SINCE CURL 7.25:
-    curl_easy_setopt(this->curlHandle, CURLOPT_TCP_KEEPALIVE, 1L);
-    curl_easy_setopt(this->curlHandle, CURLOPT_TCP_KEEPIDLE, 10L);
-    curl_easy_setopt(this->curlHandle, CURLOPT_TCP_KEEPINTVL, 10L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPIDLE, 10L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPINTVL, 10L);
     */
 
-    curl_easy_setopt(this->curlHandle, CURLOPT_URL, uri.AsString().AsCharPtr());
-    curl_easy_setopt(this->curlHandle, CURLOPT_SSL_VERIFYPEER, false);
-    curl_easy_setopt(this->curlHandle, CURLOPT_SSL_VERIFYHOST, false);
+    curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, false);
+    curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, false);
 
     long curlTimeout = (long) this->recvTimeout;
     if (curlTimeout > 0)
     {
         // this basically checks whether the connection has been interrupted
-        curl_easy_setopt(this->curlHandle, CURLOPT_LOW_SPEED_LIMIT, 50);
-        curl_easy_setopt(this->curlHandle, CURLOPT_LOW_SPEED_TIME, curlTimeout);
-    }
-    
-    // setup idle timer stuff
-    if (!this->idleTimer.Running())
-    {
-        this->idleTimer.Start();
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 50);
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, curlTimeout);
     }
-    this->lastRequestTime = this->idleTimer.GetTime();
-    return true;
 }
 
 //------------------------------------------------------------------------------
@@ -223,6 +656,12 @@ CurlHttpClient::Disconnect()
     {
         curl_easy_cleanup(this->curlHandle);
         this->curlHandle = 0;
+        this->ReleaseAltSvcCache();
+    }
+    if (0 != this->curlMultiHandle)
+    {
+        curl_multi_cleanup(this->curlMultiHandle);
+        this->curlMultiHandle = 0;
     }
 }
 
@@ -269,6 +708,252 @@ CurlHttpClient::SendRequest(const Ptr<HttpRequest>& request)
     return status;
 }
 
+//------------------------------------------------------------------------------
+/**
+    Send a batch of requests. With curl 7.28 and later the requests are
+    performed concurrently on a multi handle which is kept alive with the
+    client, so connections are reused across batches and multiplexed
+    over HTTP/2 where the server supports it. Older curl versions send
+    the requests one after another over the kept-alive connection.
+    Requests which failed with "common errors" are retried one by one.
+    The status and effective URL is set on each request; completion
+    may be partial, check each request's status if false is returned.
+*/
+bool
+CurlHttpClient::SendRequests(const Array<Ptr<HttpRequest> >& requests)
+{
+    if (requests.IsEmpty())
+    {
+        return true;
+    }
+
+    Array<HttpStatus::Code> status;
+    #if LIBCURL_VERSION_NUM >= 0x071C00
+    this->InternalSendRequests(requests, status);
+    #else
+    IndexT i;
+    for (i = 0; i < requests.Size(); i++)
+    {
+        status.Append(this->InternalSendRequest(requests[i]->CreateRequestWriter(), requests[i]->GetResponseContentStream()));
+        requests[i]->SetEffectiveUri(this->effectiveServerUrl);
+    }
+    #endif
+
+    bool allSucceeded = true;
+    IndexT reqIndex;
+    for (reqIndex = 0; reqIndex < requests.Size(); reqIndex++)
+    {
+        const Ptr<HttpRequest>& request = requests[reqIndex];
+        HttpStatus::Code httpStatus = status[reqIndex];
+        if ((httpStatus == HttpStatus::ServiceUnavailable) || (httpStatus == HttpStatus::BadGateway) || (httpStatus == HttpStatus::Nebula3CurlEasyPerformFailed))
+        {
+            request->GetResponseContentStream()->SetSize(0);
+            httpStatus = this->SendRequest(request);
+        }
+        request->SetStatus(httpStatus);
+        if (HttpStatus::OK != httpStatus)
+        {
+            allSucceeded = false;
+        }
+    }
+    this->lastRequestTime = this->idleTimer.GetTime();
+    CheckFlushPersistentCache();
+    return allSucceeded;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Add cookies in Netscape format (as returned by CURLINFO_COOKIELIST) to 
+    the cookie jar of a curl handle, existing cookies with the same name,
+    domain and path are replaced.
+*/
+void
+CurlHttpClient::ApplyCookies(const struct curl_slist* cookies, void* handle)
+{
+    const struct curl_slist* cookie;
+    for (cookie = cookies; 0 != cookie; cookie = cookie->next)
+    {
+        curl_easy_setopt(handle, CURLOPT_COOKIELIST, cookie->data);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Perform a batch of requests concurrently on the multi handle. Each
+    request gets its own fresh curl handle, setup with the same general
+    options as the client's handle (see SetupHandleOptions()), and its
+    own error buffer. TLS sessions and DNS results are shared through the
+    share handle. Cookies belong to the client, so the client's cookies 
+    are copied into each batch handle, and the cookies received by the 
+    batch handles are copied back into the client's handle.
+*/
+void
+CurlHttpClient::InternalSendRequests(const Array<Ptr<HttpRequest> >& requests, Array<HttpStatus::Code>& outStatus)
+{
+    #if LIBCURL_VERSION_NUM >= 0x071C00
+    if (!this->IsConnected())
+    {
+        bool connectResult = this->Connect(requests[0]->GetURI());
+        n_assert(connectResult);
+    }
+    if (0 == this->curlMultiHandle)
+    {
+        this->curlMultiHandle = curl_multi_init();
+        n_assert2(0 != this->curlMultiHandle, "CurlHttpClient: curl_multi_init() failed!\n");
+        #if LIBCURL_VERSION_NUM >= 0x071E00
+        // don't open dozens of connections to the same server if it can't multiplex
+        curl_multi_setopt(this->curlMultiHandle, CURLMOPT_MAX_HOST_CONNECTIONS, MaxBatchHostConnections);
+        #endif
+        #if LIBCURL_VERSION_NUM >= 0x072B00
+        curl_multi_setopt(this->curlMultiHandle, CURLMOPT_PIPELINING, (long) CURLPIPE_MULTIPLEX);
+        #endif
+    }
+
+    // the whole batch is traced as one request
+    this->BeginTrace(requests[0]->GetURI().AsString());
+
+    // setup one transfer per request
+    const SizeT numRequests = requests.Size();
+    char* errorBuffers = (char*) N3_ALLOC(Memory::ScratchHeap, numRequests * CURL_ERROR_SIZE);
+    Array<Transfer> transfers;
+    Array<void*> handles;
+    Array<CURLcode> results;
+    Array<bool> added;
+    Array<bool> completed;
+    transfers.Reserve(numRequests);
+    handles.Reserve(numRequests);
+    struct curl_slist* clientCookies = 0;
+    curl_easy_getinfo(this->curlHandle, CURLINFO_COOKIELIST, &clientCookies);
+    IndexT i;
+    for (i = 0; i < numRequests; i++)
+    {
+        void* handle = curl_easy_init();
+        n_assert2(0 != handle, "CurlHttpClient: curl_easy_init() failed!\n");
+        this->SetupHandleOptions(handle);
+        ApplyCookies(clientCookies, handle);
+        curl_easy_setopt(handle, CURLOPT_VERBOSE, this->traceActive ? 1L : 0L);
+        #if LIBCURL_VERSION_NUM >= 0x072B00
+        // rather wait for a multiplexed connection than opening a new one
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+        #endif
+        curl_easy_setopt(handle, CURLOPT_PRIVATE, (void*) (size_t) i);
+        transfers.Append(Transfer());
+        this->SetupTransfer(handle, requests[i]->CreateRequestWriter(), requests[i]->GetResponseContentStream(), errorBuffers + i * CURL_ERROR_SIZE, transfers[i]);
+        handles.Append(handle);
+        results.Append(CURLE_OK);
+        completed.Append(false);
+
+        CURLMcode addResult = curl_multi_add_handle(this->curlMultiHandle, handle);
+        added.Append(CURLM_OK == addResult);
+        if (CURLM_OK != addResult)
+        {
+            // finish the transfer right away with an error
+            strncpy(transfers[i].errorBuffer, curl_multi_strerror(addResult), CURL_ERROR_SIZE - 1);
+            transfers[i].errorBuffer[CURL_ERROR_SIZE - 1] = 0;
+            results[i] = CURLE_FAILED_INIT;
+            completed[i] = true;
+        }
+    }
+    if (0 != clientCookies)
+    {
+        curl_slist_free_all(clientCookies);
+        clientCookies = 0;
+    }
+
+    // perform all transfers until done
+    bool cancelled = false;
+    CURLMcode multiResult = CURLM_OK;
+    int numRunning = 0;
+    do
+    {
+        multiResult = curl_multi_perform(this->curlMultiHandle, &numRunning);
+        if ((CURLM_OK == multiResult) && (numRunning > 0))
+        {
+            if (this->cancelOnThreadStopRequested && Threading::Thread::GetMyThreadStopRequested())
+            {
+                n_warning("CurlHttpClient::SendRequests(): thread was requested to stop!\n");
+                cancelled = true;
+                break;
+            }
+            multiResult = curl_multi_wait(this->curlMultiHandle, 0, 0, 1000, 0);
+        }
+        if (CURLM_OK != multiResult)
+        {
+            n_warning("CurlHttpClient::SendRequests(): curl multi interface failed with '%s'!\n", curl_multi_strerror(multiResult));
+            break;
+        }
+    }
+    while (numRunning > 0);
+
+    // collect results of completed transfers
+    int numMsgs = 0;
+    CURLMsg* msg = 0;
+    while (0 != (msg = curl_multi_info_read(this->curlMultiHandle, &numMsgs)))
+    {
+        if (CURLMSG_DONE == msg->msg)
+        {
+            void* priv = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+            IndexT transferIndex = (IndexT) (size_t) priv;
+            results[transferIndex] = msg->data.result;
+            completed[transferIndex] = true;
+        }
+    }
+
+    // evaluate and cleanup transfers
+    IndexT firstFailed = InvalidIndex;
+    for (i = 0; i < numRequests; i++)
+    {
+        // detach from the multi handle first, the transfer's buffers are released in FinishTransfer()
+        if (added[i])
+        {
+            curl_multi_remove_handle(this->curlMultiHandle, handles[i]);
+        }
+        if (!completed[i] && !cancelled)
+        {
+            // the multi interface failed before this transfer was done
+            n_assert(CURLM_OK != multiResult);
+            strncpy(transfers[i].errorBuffer, curl_multi_strerror(multiResult), CURL_ERROR_SIZE - 1);
+            transfers[i].errorBuffer[CURL_ERROR_SIZE - 1] = 0;
+            results[i] = CURLE_FAILED_INIT;
+        }
+        HttpStatus::Code httpStatus = this->FinishTransfer(handles[i], transfers[i], results[i]);
+        if (!completed[i] && cancelled)
+        {
+            // just "abuse" a NotFound http status, like SendRequest() does
+            httpStatus = HttpStatus::NotFound;
+        }
+        requests[i]->SetEffectiveUri(this->effectiveServerUrl);
+        outStatus.Append(httpStatus);
+        if ((InvalidIndex == firstFailed) && ((CURLE_OK != results[i]) || (HttpStatus::OK != httpStatus)))
+        {
+            firstFailed = i;
+        }
+
+        // take over cookies received by this transfer
+        struct curl_slist* cookies = 0;
+        if ((CURLE_OK == curl_easy_getinfo(handles[i], CURLINFO_COOKIELIST, &cookies)) && (0 != cookies))
+        {
+            ApplyCookies(cookies, this->curlHandle);
+            curl_slist_free_all(cookies);
+        }
+        curl_easy_cleanup(handles[i]);
+    }
+
+    // make the first error available through GetErrorDesc() and the trace
+    if (InvalidIndex != firstFailed)
+    {
+        Memory::Copy(transfers[firstFailed].errorBuffer, this->curlError, CURL_ERROR_SIZE);
+        this->EndTrace(results[firstFailed], outStatus[firstFailed]);
+    }
+    else
+    {
+        this->curlError[0] = 0;
+        this->EndTrace(CURLE_OK, HttpStatus::OK);
+    }
+    N3_FREE(Memory::ScratchHeap, errorBuffers);
+    #endif
+}
 
 //------------------------------------------------------------------------------
 /**
@@ -308,20 +993,221 @@ CurlHttpClient::SendRequest(const Ptr<HttpRequestWriter>& requestWriter, const P
     }
 
     this->lastRequestTime = this->idleTimer.GetTime();
+    CheckFlushPersistentCache();
     return httpStatus;
 }
 
 //------------------------------------------------------------------------------
 /**
+    Curl debug callback, only active while the current request is traced.
+    User data is expected to be a pointer to the owning CurlHttpClient.
+    Only info texts and headers are recorded, payload data is ignored.
 */
 int 
 CurlHttpClient::CurlDebugCallback(CURL *handle, curl_infotype type, char *data, size_t size, void *userptr)
 {
-    String s = data;
-    n_dbgout("CurlHttpClient::CurlDebugCallback(): %s\n", s.AsCharPtr());
+    CurlHttpClient* self = (CurlHttpClient*) userptr;
+    if (self->traceActive)
+    {
+        switch (type)
+        {
+            case CURLINFO_TEXT:
+                self->AddTraceRecord(TraceText, 0, data, size);
+                break;
+            case CURLINFO_HEADER_IN:
+                self->AddTraceRecord(TraceHeaderIn, 0, data, size);
+                break;
+            case CURLINFO_HEADER_OUT:
+                self->AddTraceRecord(TraceHeaderOut, 0, data, size);
+                break;
+            default:
+                break;
+        }
+    }
     return 0;
 }
 
+//------------------------------------------------------------------------------
+/**
+    Add a record to the trace ring buffer, overwriting the oldest record
+    when the buffer is full. The text is truncated to TraceTextSize bytes
+    and doesn't need to be 0-terminated. The ring buffer is owned by the
+    client (and thus by one thread), so no locking is required here.
+*/
+void
+CurlHttpClient::AddTraceRecord(TraceEventType type, int value, const char* text, size_t size)
+{
+    n_assert(0 != this->traceRecords);
+
+    // strip trailing line breaks, curl hands out complete header lines
+    while ((size > 0) && (('\n' == text[size - 1]) || ('\r' == text[size - 1])))
+    {
+        size--;
+    }
+    if (size > TraceTextSize)
+    {
+        size = TraceTextSize;
+    }
+
+    TraceRecord& rec = this->traceRecords[this->traceHead];
+    rec.time = processTimer.GetTime();
+    rec.requestIndex = this->traceRequestIndex;
+    rec.value = value;
+    rec.type = (ushort) type;
+    rec.textSize = (ushort) size;
+    if (size > 0)
+    {
+        Memory::Copy(text, rec.text, size);
+        MaskTraceText(rec.text, size);
+    }
+
+    this->traceHead = (this->traceHead + 1) % NumTraceRecords;
+    if (this->traceNumRecords < NumTraceRecords)
+    {
+        this->traceNumRecords++;
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Overwrite the values of sensitive header fields with '*' in place, so 
+    that auth tokens and cookies never end up in the log. Header names are
+    matched case-insensitively anywhere in the text, since outgoing headers
+    come as one block and HTTP/2 headers are reported as "[name: value]" 
+    info texts. A value ends at a line break or a closing bracket.
+*/
+void
+CurlHttpClient::MaskTraceText(char* text, size_t size)
+{
+    static const char* sensitiveFields[] = { "x-auth-token:", "cookie:", "authorization:" };
+    static const SizeT numSensitiveFields = sizeof(sensitiveFields) / sizeof(sensitiveFields[0]);
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t valueStart = 0;
+        IndexT fieldIndex;
+        for (fieldIndex = 0; (fieldIndex < numSensitiveFields) && (0 == valueStart); fieldIndex++)
+        {
+            const char* field = sensitiveFields[fieldIndex];
+            size_t len = strlen(field);
+            if ((size - pos) >= len)
+            {
+                size_t i;
+                for (i = 0; (i < len) && (tolower((uchar) text[pos + i]) == field[i]); i++);
+                if (i == len)
+                {
+                    valueStart = pos + len;
+                }
+            }
+        }
+        if (0 == valueStart)
+        {
+            pos++;
+            continue;
+        }
+
+        // skip whitespace after the colon, then mask up to the end of the value
+        while ((valueStart < size) && (' ' == text[valueStart]))
+        {
+            valueStart++;
+        }
+        for (pos = valueStart; (pos < size) && ('\r' != text[pos]) && ('\n' != text[pos]) && (']' != text[pos]); pos++)
+        {
+            text[pos] = '*';
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Decide whether the next request is traced (tracing must be enabled and
+    the request must be sampled), and switch curl's verbose mode accordingly.
+    The ring buffer is allocated once when the first request is traced.
+*/
+void
+CurlHttpClient::BeginTrace(const String& url)
+{
+    this->traceRequestIndex++;
+    bool active = traceEnabled && ((this->traceRequestIndex % traceSampleInterval) == 0);
+    if (active != this->traceActive)
+    {
+        curl_easy_setopt(this->curlHandle, CURLOPT_VERBOSE, active ? 1L : 0L);
+        this->traceActive = active;
+    }
+    if (active)
+    {
+        if (0 == this->traceRecords)
+        {
+            this->traceRecords = (TraceRecord*) N3_ALLOC(Memory::NetworkHeap, NumTraceRecords * sizeof(TraceRecord));
+        }
+        this->AddTraceRecord(TraceRequestBegin, 0, url.AsCharPtr(), url.Length());
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Record the result of the current request. If the request failed and
+    dump-on-error is enabled, all records of this request are written to the log.
+*/
+void
+CurlHttpClient::EndTrace(CURLcode performResult, HttpStatus::Code httpStatus)
+{
+    if (this->traceActive)
+    {
+        const char* errorDesc = (CURLE_OK != performResult) ? this->curlError : "";
+        this->AddTraceRecord(TraceRequestEnd, (int) httpStatus, errorDesc, String::StrLen(errorDesc));
+
+        bool failed = ((CURLE_OK != performResult) && (CURLE_PARTIAL_FILE != performResult)) || (int(httpStatus) >= 400);
+        if (failed && dumpTraceOnError)
+        {
+            this->DumpTraceRecords(false, this->traceRequestIndex);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+CurlHttpClient::DumpTrace() const
+{
+    this->DumpTraceRecords(true, 0);
+}
+
+//------------------------------------------------------------------------------
+/**
+    Write trace records to the log, from oldest to newest. If 'all' is false,
+    only records of the given request index are written.
+*/
+void
+CurlHttpClient::DumpTraceRecords(bool all, uint requestIndex) const
+{
+    static const char* typeNames[NumTraceEventTypes] = { "BEGIN", "TEXT", "<", ">", "END" };
+    if (0 == this->traceRecords)
+    {
+        return;
+    }
+    IndexT first = (this->traceHead + NumTraceRecords - this->traceNumRecords) % NumTraceRecords;
+    IndexT i;
+    for (i = 0; i < this->traceNumRecords; i++)
+    {
+        const TraceRecord& rec = this->traceRecords[(first + i) % NumTraceRecords];
+        if (all || (rec.requestIndex == requestIndex))
+        {
+            if (TraceRequestEnd == rec.type)
+            {
+                n_printf("CurlHttpClient trace [%.3f] #%u %s httpCode='%d' %.*s\n",
+                    rec.time, rec.requestIndex, typeNames[rec.type], rec.value, (int) rec.textSize, rec.text);
+            }
+            else
+            {
+                n_printf("CurlHttpClient trace [%.3f] #%u %s %.*s\n",
+                    rec.time, rec.requestIndex, typeNames[rec.type], (int) rec.textSize, rec.text);
+            }
+        }
+    }
+}
+
 //------------------------------------------------------------------------------
 /**
 */
@@ -334,12 +1220,13 @@ CurlHttpClient::modifyUrlToHttps(const std::string& httpUrlString) {
     }
     return String(httpsUrlString.c_str());
     }
-    
+
+//------------------------------------------------------------------------------
+/**
+*/
 HttpStatus::Code
 CurlHttpClient::InternalSendRequest(const Ptr<HttpRequestWriter>& requestWriter, const Ptr<Stream>& responseContentStream)
 {
-    HttpStatus::Code httpStatus = HttpStatus::OK;
-
     // first make sure we're connected (this actually cannot fail in the CurlHttpClient implementation
     if (!this->IsConnected())
     {
@@ -347,35 +1234,58 @@ CurlHttpClient::InternalSendRequest(const Ptr<HttpRequestWriter>& requestWriter,
         n_assert(connectResult);
     }
 
-    // set URL in curl
-    String httpUrlString = requestWriter->GetURI().AsString();
+    Transfer transfer;
+    String httpsUrlString = this->SetupTransfer(this->curlHandle, requestWriter, responseContentStream, this->curlError, transfer);
 
-    #if __NEBULA3_HTTP_FILESYSTEM_CURL_VERBOSE_MODE__
-    data d;
-    d.trace_ascii = 1;
-    curl_easy_setopt(this->curlHandle, CURLOPT_DEBUGFUNCTION, CurlHttpClient::CurlDebugCallback);
-    curl_easy_setopt(this->curlHandle, CURLOPT_DEBUGDATA, &d);
-    curl_easy_setopt(this->curlHandle, CURLOPT_VERBOSE, 1);
-    #endif
-    String httpsUrlString = modifyUrlToHttps(httpUrlString.AsCharPtr());
-    curl_easy_setopt(this->curlHandle, CURLOPT_URL, httpsUrlString.AsCharPtr());
+    // setup transfer tracing (can be toggled at runtime, see SetTraceEnabled())
+    this->BeginTrace(httpsUrlString);
 
+    // finally, perform the HTTP request and get the HTTP status code back
+    CURLcode performResult = curl_easy_perform(this->curlHandle);
+    HttpStatus::Code httpStatus = this->FinishTransfer(this->curlHandle, transfer, performResult);
+    this->EndTrace(performResult, httpStatus);
+    return httpStatus;
+}
 
+//------------------------------------------------------------------------------
+/**
+    Setup a curl easy handle for a request: URL, HTTP method, header fields,
+    request content and response content stream. The transfer object
+    keeps everything that must be cleaned up in FinishTransfer().
+    Returns the actual (https) URL of the request.
+*/
+String
+CurlHttpClient::SetupTransfer(void* handle, const Ptr<HttpRequestWriter>& requestWriter, const Ptr<Stream>& responseContentStream, char* errorBuffer, Transfer& transfer)
+{
+    transfer.requestWriter = requestWriter;
+    transfer.responseContentStream = responseContentStream;
+    transfer.headers = 0;
+    transfer.postData = 0;
+    transfer.errorBuffer = errorBuffer;
+
+    // clear the error buffer, so that errors of previous requests don't show up
+    errorBuffer[0] = 0;
+    curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, errorBuffer);
+
+    // set URL in curl
+    String httpUrlString = requestWriter->GetURI().AsString();
+    String httpsUrlString = modifyUrlToHttps(httpUrlString.AsCharPtr());
+    curl_easy_setopt(handle, CURLOPT_URL, httpsUrlString.AsCharPtr());
 
     // set HTTP method in curl
     switch (requestWriter->GetMethod())
     {
         case HttpMethod::Get:
-            curl_easy_setopt(this->curlHandle, CURLOPT_HTTPGET, 1);
+            curl_easy_setopt(handle, CURLOPT_HTTPGET, 1);
             break;
         case HttpMethod::Post:
-            curl_easy_setopt(this->curlHandle, CURLOPT_POST, 1);
+            curl_easy_setopt(handle, CURLOPT_POST, 1);
             break;
         case HttpMethod::Put:
-            curl_easy_setopt(this->curlHandle, CURLOPT_CUSTOMREQUEST, "PUT");
+            curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, "PUT");
             break;
         default:
-            n_error("CurlHttpClient::InternalSendRequest(): unsupported http method!\n");
+            n_error("CurlHttpClient::SetupTransfer(): unsupported http method!\n");
             break;
     }
 
@@ -419,7 +1329,8 @@ CurlHttpClient::InternalSendRequest(const Ptr<HttpRequestWriter>& requestWriter,
     headers = curl_slist_append(headers, "Keep-Alive: 300");
 
     n_assert(0 != headers);
-    curl_easy_setopt(this->curlHandle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+    transfer.headers = headers;
 
     // if POST is used, set the data to post
     void* postData = 0;
@@ -437,42 +1348,54 @@ CurlHttpClient::InternalSendRequest(const Ptr<HttpRequestWriter>& requestWriter,
         }
         if (0 != postData)
         {
-            curl_easy_setopt(this->curlHandle, CURLOPT_POSTFIELDS, postData);
-            curl_easy_setopt(this->curlHandle, CURLOPT_POSTFIELDSIZE, postDataSize);
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDS, postData);
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, postDataSize);
         }
         else {
             // see: http://curl.haxx.se/libcurl/c/CURLOPT_POSTFIELDS.html
-            curl_easy_setopt(this->curlHandle, CURLOPT_POSTFIELDSIZE, 0);
-            curl_easy_setopt(this->curlHandle, CURLOPT_POSTFIELDS, 0L);
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, 0);
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDS, 0L);
         }
     }
+    transfer.postData = postData;
 
     // take care of the received data...
     responseContentStream->SetAccessMode(Stream::WriteAccess);
     if (!responseContentStream->Open())
     {
-        n_error("CurlHttpClient::InternalSendRequest(): failed to open responseContentStream!\n");
+        n_error("CurlHttpClient::SetupTransfer(): failed to open responseContentStream!\n");
     }
-    curl_easy_setopt(this->curlHandle, CURLOPT_WRITEDATA, responseContentStream.get());
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, responseContentStream.get());
+
+    return httpsUrlString;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Evaluate the result of a finished transfer (HTTP status code, effective
+    URL and redirect count) and cleanup everything setup by SetupTransfer().
+*/
+HttpStatus::Code
+CurlHttpClient::FinishTransfer(void* handle, Transfer& transfer, CURLcode performResult)
+{
+    const Ptr<HttpRequestWriter>& requestWriter = transfer.requestWriter;
+    const Ptr<Stream>& responseContentStream = transfer.responseContentStream;
 
-    // finally, perform the HTTP request and get the HTTP status code back
-    
-    CURLcode performResult = curl_easy_perform(this->curlHandle);
     long curlHttpCode = 0;
-    curl_easy_getinfo(this->curlHandle, CURLINFO_RESPONSE_CODE, &curlHttpCode);
-    httpStatus = (HttpStatus::Code) curlHttpCode;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &curlHttpCode);
+    HttpStatus::Code httpStatus = (HttpStatus::Code) curlHttpCode;
     if (CURLE_PARTIAL_FILE == performResult)
     {
         // NOTE: This is the most prominent download error in the wild, and means that CURL
         // didn't receive the final chunk of a chunked file transform. We will treat this
         // as a warning for now. If the download is corrupted, then the MD5 check will complain later on.
-        n_warning("CurlHttpRequest::InternalSendRequest(%s): curl_easy_perform() returned with CURLE_PARTIAL_FILE httpCode='%ld'\n",
+        n_warning("CurlHttpClient::FinishTransfer(%s): transfer returned with CURLE_PARTIAL_FILE httpCode='%ld'\n",
             requestWriter->GetURI().AsString().AsCharPtr(), curlHttpCode);
     }
     else if (0 != performResult)
     {
-        n_warning("CurlHttpRequest::InternalSendRequest(%s): curl_easy_perform() failed with '%s', httpCode='%ld'\n", 
-            requestWriter->GetURI().AsString().AsCharPtr(), this->curlError, curlHttpCode);
+        n_warning("CurlHttpClient::FinishTransfer(%s): transfer failed with '%s', httpCode='%ld'\n", 
+            requestWriter->GetURI().AsString().AsCharPtr(), transfer.errorBuffer, curlHttpCode);
         
         // hmm looks like CURL returns HTTP OK even if the connection went down halfway through the download
         // if this happens, replace the http code with Nebula3CurlEasyPerformFailed
@@ -484,35 +1407,37 @@ CurlHttpClient::InternalSendRequest(const Ptr<HttpRequestWriter>& requestWriter,
 
     // get effective url for redirects
     char *effectiveUrl;
-    CURLcode effectiveUrlResult = curl_easy_getinfo(this->curlHandle, CURLINFO_EFFECTIVE_URL, &effectiveUrl);
+    CURLcode effectiveUrlResult = curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &effectiveUrl);
     if (CURLE_OK == effectiveUrlResult && effectiveUrl)
     {
         this->effectiveServerUrl = IO::URI(effectiveUrl);
     }
     // get redirect count
     long redirectCount = 0;
-    CURLcode redirectCountResult = curl_easy_getinfo(this->curlHandle, CURLINFO_REDIRECT_COUNT, &redirectCount);
+    CURLcode redirectCountResult = curl_easy_getinfo(handle, CURLINFO_REDIRECT_COUNT, &redirectCount);
     if (CURLE_OK == redirectCountResult)
     {
         this->redirectResponseCount = redirectCount;
     }
 
     // perform cleanup
-    curl_easy_setopt(this->curlHandle, CURLOPT_WRITEDATA, 0);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, 0);
     if (responseContentStream->IsOpen())
     {
         responseContentStream->Close();
     }
-    if (0 != postData)
+    if (0 != transfer.postData)
     {
+        const Ptr<Stream>& requestContentStream = requestWriter->GetContentStream();
         n_assert(requestContentStream.isvalid());
         requestContentStream->Unmap();
         requestContentStream->Close();
+        transfer.postData = 0;
     }
-    if (0 != headers)
+    if (0 != transfer.headers)
     {
-        curl_slist_free_all(headers);
-        headers = 0;
+        curl_slist_free_all(transfer.headers);
+        transfer.headers = 0;
     }
 
     return httpStatus;
@@ -16,6 +16,7 @@
 #include "http/httprequestwriter.h"
 #include "io/uri.h"
 #include "timing/timer.h"
+#include "util/array.h"
 #include <string>
 #if __WIN32__
 // under Windows, make sure to use the self-compiled CURL
@@ -69,6 +70,8 @@ public:
     HttpStatus::Code SendRequest(const Ptr<HttpRequest>& request);
     /// send a request with a completely configured HttpRequestWriter object (can also be used for PUT and POST)
     HttpStatus::Code SendRequest(const Ptr<HttpRequestWriter>& requestWriter, const Ptr<IO::Stream>& responseContentStream, SizeT maxRetries = __NEBULA3_HTTP_FILESYSTEM_MAX_RETRIES__);
+    /// send a batch of requests at once over reused or multiplexed connections, sets status and effective URL on each request, returns true if all requests succeeded
+    bool SendRequests(const Util::Array<Ptr<HttpRequest> >& requests);
     /// get extended error information (if the last request failed)
     Util::String GetErrorDesc() const;
     /// get effective server url
@@ -78,6 +81,32 @@ public:
     /// change http to https 
     Util::String modifyUrlToHttps(const std::string& httpUrlString);
 
+    /// set directory for the persistent TLS session (requires curl 8.12) and Alt-Svc (requires curl 7.64.1) cache files, must be called before the first client is created
+    static void SetPersistentCacheDirectory(const Util::String& dir);
+    /// get directory of the persistent cache files
+    static const Util::String& GetPersistentCacheDirectory();
+    /// set interval in seconds in which the persistent cache is flushed after requests (default is 60)
+    static void SetPersistentCacheFlushInterval(Timing::Time secs);
+    /// get persistent cache flush interval in seconds
+    static Timing::Time GetPersistentCacheFlushInterval();
+    /// write the shared TLS sessions to the persistent cache file now (also happens automatically)
+    static void FlushPersistentCache();
+
+    /// enable or disable transfer tracing at runtime for all clients (default is off unless curl verbose mode is compiled in)
+    static void SetTraceEnabled(bool b);
+    /// return true if transfer tracing is enabled
+    static bool IsTraceEnabled();
+    /// set trace sample interval, only every Nth request of a client is traced (default is 1)
+    static void SetTraceSampleInterval(SizeT n);
+    /// get trace sample interval
+    static SizeT GetTraceSampleInterval();
+    /// set to true if the trace of a failed request should be dumped automatically (default is true)
+    static void SetDumpTraceOnError(bool b);
+    /// get the dump-trace-on-error flag
+    static bool GetDumpTraceOnError();
+    /// dump all recorded trace records of this client to the log (must be called from the client's thread)
+    void DumpTrace() const;
+
 protected:
     /// malloc callback for curl
     static void* CurlMalloc(size_t size);
@@ -94,14 +123,106 @@ protected:
     /// internal send request method
     HttpStatus::Code InternalSendRequest(const Ptr<HttpRequestWriter>& requestWriter, const Ptr<IO::Stream>& responseContentStream);
 
-    /// used by cURL verbose mode
-    struct data {
-        char trace_ascii; /* 1 or 0 */
+    /// per-transfer state between SetupTransfer() and FinishTransfer()
+    struct Transfer
+    {
+        Ptr<HttpRequestWriter> requestWriter;
+        Ptr<IO::Stream> responseContentStream;
+        struct curl_slist* headers;
+        void* postData;
+        char* errorBuffer;
+    };
+    /// max number of parallel connections per host for batched requests
+    static const long MaxBatchHostConnections = 4;
+    /// set the general options shared by all curl easy handles of this client
+    void SetupHandleOptions(void* handle);
+    /// setup a curl easy handle for a request, errorBuffer must hold at least CURL_ERROR_SIZE bytes, returns the actual request URL
+    Util::String SetupTransfer(void* handle, const Ptr<HttpRequestWriter>& requestWriter, const Ptr<IO::Stream>& responseContentStream, char* errorBuffer, Transfer& transfer);
+    /// evaluate the result of a transfer and cleanup, returns the HTTP status
+    HttpStatus::Code FinishTransfer(void* handle, Transfer& transfer, CURLcode performResult);
+    /// add a list of cookies (as returned by CURLINFO_COOKIELIST) to a curl handle's cookie jar
+    static void ApplyCookies(const struct curl_slist* cookies, void* handle);
+    /// perform a batch of transfers concurrently on the curl multi handle
+    void InternalSendRequests(const Util::Array<Ptr<HttpRequest> >& requests, Util::Array<HttpStatus::Code>& outStatus);
+
+    /// setup process-wide curl share handle and persistent cache file names (called once)
+    static void SetupSharedCache();
+    /// load the persistent cache file into the shared TLS session cache
+    static void LoadPersistentCache();
+    /// write the shared TLS session cache into the persistent cache file (persistentCacheCriticalSection must be held)
+    static void WritePersistentCache();
+    /// flush the persistent cache after the first request or if the flush interval has passed
+    static void CheckFlushPersistentCache();
+    /// exit hook which flushes the persistent cache
+    static void PersistentCacheAtExit();
+    /// attach the persistent Alt-Svc cache to the client's curl handle
+    void AttachAltSvcCache();
+    /// release Alt-Svc cache ownership after the client's curl handle has been cleaned up
+    void ReleaseAltSvcCache();
+    #if LIBCURL_VERSION_NUM >= 0x080C00
+    /// TLS session export callback for curl, user data is the FILE* of the cache file
+    static CURLcode CurlSslsExport(CURL* handle, void* userptr, const char* sessionKey, const unsigned char* shmac, size_t shmacLen, const unsigned char* sdata, size_t sdataLen, curl_off_t validUntil, int ietfTlsId, const char* alpn, size_t earlyDataMax);
+    #endif
+    /// lock callback for the curl share handle
+    static void CurlShareLock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr);
+    /// unlock callback for the curl share handle
+    static void CurlShareUnlock(CURL* handle, curl_lock_data data, void* userptr);
+
+    /// trace event types
+    enum TraceEventType
+    {
+        TraceRequestBegin = 0,
+        TraceText,
+        TraceHeaderIn,
+        TraceHeaderOut,
+        TraceRequestEnd,
+
+        NumTraceEventTypes,
+    };
+    /// number of records in the trace ring buffer
+    static const SizeT NumTraceRecords = 256;
+    /// max number of text bytes stored per trace record, longer texts are truncated
+    static const SizeT TraceTextSize = 104;
+    /// a fixed-size trace record
+    struct TraceRecord
+    {
+        Timing::Time time;
+        uint requestIndex;
+        int value;
+        ushort type;
+        ushort textSize;
+        char text[TraceTextSize];
     };
-    /// callback method for curl verbose mode
+    /// callback method for curl verbose mode, records into the trace ring buffer
     static int CurlDebugCallback(CURL *handle, curl_infotype type, char *data, size_t size, void *userptr);
+    /// decide whether the next request is traced and setup curl accordingly
+    void BeginTrace(const Util::String& url);
+    /// finish tracing of the current request, dumps the request's trace if it failed
+    void EndTrace(CURLcode performResult, HttpStatus::Code httpStatus);
+    /// add a record to the trace ring buffer (never allocates)
+    void AddTraceRecord(TraceEventType type, int value, const char* text, size_t size);
+    /// mask the values of sensitive header fields (auth tokens, cookies) in trace text
+    static void MaskTraceText(char* text, size_t size);
+    /// dump trace records, either all or only those of one request
+    void DumpTraceRecords(bool all, uint requestIndex) const;
 
     static bool curlInitCalled;
+    static Timing::Timer processTimer;
+    static CURLSH* curlShareHandle;
+    static Threading::CriticalSection curlShareCriticalSections[CURL_LOCK_DATA_LAST];
+    static Util::String persistentCacheDirectory;
+    static Util::String persistentCacheFile;
+    static Timing::Time persistentCacheFlushInterval;
+    static Timing::Time persistentCacheFlushTime;
+    static Threading::CriticalSection persistentCacheCriticalSection;
+    static CURL* persistentCacheHandle;
+    static bool persistentCacheWritten;
+    static Util::String altSvcCacheFile;
+    static bool altSvcCacheOwned;
+    static SizeT numClients;
+    static bool traceEnabled;
+    static SizeT traceSampleInterval;
+    static bool dumpTraceOnError;
     static Threading::CriticalSection curlInitCriticalSection;
     bool fillResponseContentStreamOnError;
     bool cancelOnThreadStopRequested;
@@ -109,10 +230,17 @@ protected:
     IO::URI effectiveServerUrl;
     int recvTimeout;
     void* curlHandle;
+    void* curlMultiHandle;
     char* curlError;
     Timing::Timer idleTimer;
     Timing::Time lastRequestTime;
     long redirectResponseCount;
+    TraceRecord* traceRecords;
+    IndexT traceHead;
+    SizeT traceNumRecords;
+    uint traceRequestIndex;
+    bool traceActive;
+    bool altSvcCacheOwner;
 }; 
 
 //------------------------------------------------------------------------------
@@ -187,6 +315,98 @@ CurlHttpClient::GetRedirectCount() const
     return this->redirectResponseCount;
 }
 
+//------------------------------------------------------------------------------
+/**
+*/
+inline void
+CurlHttpClient::SetPersistentCacheDirectory(const Util::String& dir)
+{
+    n_assert2(!curlInitCalled, "CurlHttpClient::SetPersistentCacheDirectory() must be called before the first client is created!\n");
+    persistentCacheDirectory = dir;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+inline const Util::String&
+CurlHttpClient::GetPersistentCacheDirectory()
+{
+    return persistentCacheDirectory;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+inline void
+CurlHttpClient::SetPersistentCacheFlushInterval(Timing::Time secs)
+{
+    persistentCacheFlushInterval = secs;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+inline Timing::Time
+CurlHttpClient::GetPersistentCacheFlushInterval()
+{
+    return persistentCacheFlushInterval;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+inline void
+CurlHttpClient::SetTraceEnabled(bool b)
+{
+    traceEnabled = b;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+inline bool
+CurlHttpClient::IsTraceEnabled()
+{
+    return traceEnabled;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+inline void
+CurlHttpClient::SetTraceSampleInterval(SizeT n)
+{
+    n_assert(n > 0);
+    traceSampleInterval = n;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+inline SizeT
+CurlHttpClient::GetTraceSampleInterval()
+{
+    return traceSampleInterval;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+inline void
+CurlHttpClient::SetDumpTraceOnError(bool b)
+{
+    dumpTraceOnError = b;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+inline bool
+CurlHttpClient::GetDumpTraceOnError()
+{
+    return dumpTraceOnError;
+}
+
 } // namespace Http
 //------------------------------------------------------------------------------
 #endif // __NEBULA3_CURL_HTTPCLIENT__
\ No newline at end of file